@@ -1,18 +1,37 @@
-﻿#include <chrono>
+﻿#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
 #include <ctime>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
 #include <thread>
 #include <vector>
 #include <string>
 #include <cmath>
+#include <cstdint>
+#include <unordered_map>
 #include <queue>
 #include <algorithm>
 #include <random>
 
 #include <conio.h>
 #include <windows.h>
+#if defined(_MSC_VER)
+#define BACKROOMS_NOINLINE __declspec(noinline)
+#else
+#define BACKROOMS_NOINLINE __attribute__((noinline))
+#endif
+#if defined(_M_X64) || defined(__SSE2__)
+#define BACKROOMS_SSE2 1
+#include <emmintrin.h>
+#endif
 #include "json.hpp"
 
 using json = nlohmann::json;
@@ -34,9 +53,39 @@ const char kPlayer = 'P';
 const int WINNING_BOTTLES_COUNT = 10;
 bool game_won = false;
 
+struct LevelEntry {
+    string file;
+    string name;
+    unsigned int seed = 0;
+    int width = 40;
+    int height = 20;
+    bool procedural = false;
+};
+
+struct LevelData {
+    string name;
+    int width = 40;
+    int height = 20;
+    vector<vector<bool>> walls;
+    int spawn_x = 0, spawn_y = 0;
+    vector<std::pair<int, int>> free_cells;
+    vector<int> spawn_distance;
+};
+
+vector<LevelEntry> level_sequence;
+int current_level = 0;
+string level_name;
+std::future<LevelData> next_level;
+long long last_transition_us = -1;
+
 const int kPlayerColor = 10;
 const int kWallColor = 7;
 const int kTextColor = 7;
+const int kFogColor = 8;
+
+const int kViewRadius = 8;
+const int kChaseRadius = 2 * kViewRadius;
+const size_t kMaxCachedViews = 256;
 
 vector<vector<bool>> walls;
 int player_x, player_y;
@@ -44,6 +93,9 @@ int time_bonus = 0;
 int timer = 60;
 bool game_over;
 int bottles_collected = 0;
+int level_bottles = 0;
+vector<std::pair<int, int>> free_cells;
+vector<int> spawn_distance;
 steady_clock::time_point start_time;
 HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
 
@@ -52,9 +104,470 @@ steady_clock::time_point player_invisible_until;
 bool monster_frozen = false;
 bool player_invisible = false;
 
-vector<string> screen_buffer;
+vector<char> screen_buffer;
 vector<WORD> color_buffer;
 
+enum Counter {
+    kTicks,
+    kFramesRendered,
+    kBytesWritten,
+    kPathSearches,
+    kPathNodesExpanded,
+    kItemsSpawned,
+    kSpawnRetries,
+    kAllocations,
+    kCounterCount
+};
+
+enum Histogram {
+    kTickMicros,
+    kAllocationsPerTick,
+    kPathNodesPerSearch,
+    kHistogramCount
+};
+
+const int kHistogramBuckets = 12;
+
+struct CounterInfo {
+    const char* name;
+    const char* help;
+};
+
+// Values are recorded as integers; scale converts them to the exported base
+// unit (e.g. microseconds to seconds) for the bounds and the sum.
+struct HistogramInfo {
+    const char* name;
+    const char* help;
+    double scale;
+    uint64_t bounds[kHistogramBuckets];
+};
+
+const CounterInfo kCounterInfo[kCounterCount] = {
+    { "backrooms_ticks_total", "Game loop ticks executed." },
+    { "backrooms_frames_rendered_total", "Frames drawn to the console." },
+    { "backrooms_terminal_bytes_total", "Bytes written to the terminal." },
+    { "backrooms_path_searches_total", "Enemy pathfinding searches." },
+    { "backrooms_path_nodes_expanded_total", "Cells expanded by enemy pathfinding." },
+    { "backrooms_items_spawned_total", "Items placed on the map." },
+    { "backrooms_spawn_retries_total", "Rejected item placement attempts." },
+    { "backrooms_allocations_total", "Heap allocations made by the game loop and the level preloader." },
+};
+
+const HistogramInfo kHistogramInfo[kHistogramCount] = {
+    { "backrooms_tick_duration_seconds", "Time spent in one tick, excluding the frame sleep.", 1e-6,
+        { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000 } },
+    { "backrooms_allocations_per_tick", "Heap allocations made during one tick.", 1.0,
+        { 0, 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024 } },
+    { "backrooms_path_nodes_per_search", "Cells expanded by one pathfinding search.", 1.0,
+        { 1, 4, 16, 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304 } },
+};
+
+// Each thread writes only to its own shard, so recording is a relaxed load
+// and store with no contention; the exporter sums the shards when it dumps.
+struct MetricsShard {
+    std::atomic<uint64_t> counters[kCounterCount] = {};
+    std::atomic<uint64_t> buckets[kHistogramCount][kHistogramBuckets + 1] = {};
+    std::atomic<uint64_t> sums[kHistogramCount] = {};
+};
+
+class MetricsRegistry {
+public:
+    void add(Counter counter, uint64_t amount = 1) {
+        bump(local().counters[counter], amount);
+    }
+
+    void observe(Histogram histogram, uint64_t value) {
+        MetricsShard& shard = local();
+        const uint64_t* bounds = kHistogramInfo[histogram].bounds;
+        int bucket = 0;
+        while (bucket < kHistogramBuckets && value > bounds[bucket]) {
+            bucket++;
+        }
+        bump(shard.buckets[histogram][bucket], 1);
+        bump(shard.sums[histogram], value);
+    }
+
+    string toPrometheus() {
+        uint64_t counters[kCounterCount] = {};
+        uint64_t buckets[kHistogramCount][kHistogramBuckets + 1] = {};
+        uint64_t sums[kHistogramCount] = {};
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto& shard : shards) {
+                for (int c = 0; c < kCounterCount; c++) {
+                    counters[c] += shard->counters[c].load(std::memory_order_relaxed);
+                }
+                for (int h = 0; h < kHistogramCount; h++) {
+                    for (int b = 0; b <= kHistogramBuckets; b++) {
+                        buckets[h][b] += shard->buckets[h][b].load(std::memory_order_relaxed);
+                    }
+                    sums[h] += shard->sums[h].load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        std::ostringstream out;
+        out.precision(15);
+        for (int c = 0; c < kCounterCount; c++) {
+            out << "# HELP " << kCounterInfo[c].name << " " << kCounterInfo[c].help << "\n";
+            out << "# TYPE " << kCounterInfo[c].name << " counter\n";
+            out << kCounterInfo[c].name << " " << counters[c] << "\n";
+        }
+        for (int h = 0; h < kHistogramCount; h++) {
+            const HistogramInfo& info = kHistogramInfo[h];
+            out << "# HELP " << info.name << " " << info.help << "\n";
+            out << "# TYPE " << info.name << " histogram\n";
+            uint64_t cumulative = 0;
+            for (int b = 0; b < kHistogramBuckets; b++) {
+                cumulative += buckets[h][b];
+                out << info.name << "_bucket{le=\"" << info.bounds[b] * info.scale << "\"} " << cumulative << "\n";
+            }
+            cumulative += buckets[h][kHistogramBuckets];
+            out << info.name << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+            out << info.name << "_sum " << sums[h] * info.scale << "\n";
+            out << info.name << "_count " << cumulative << "\n";
+        }
+        return out.str();
+    }
+
+private:
+    static void bump(std::atomic<uint64_t>& value, uint64_t amount) {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    // Shards outlive their threads so counts from a finished preload thread
+    // still show up in later dumps.
+    MetricsShard& local() {
+        thread_local MetricsShard* shard = nullptr;
+        if (!shard) {
+            std::lock_guard<std::mutex> lock(mutex);
+            shards.push_back(std::make_unique<MetricsShard>());
+            shard = shards.back().get();
+        }
+        return *shard;
+    }
+
+    std::mutex mutex;
+    vector<std::unique_ptr<MetricsShard>> shards;
+};
+
+MetricsRegistry metrics;
+
+// Plain per-thread tally bumped by the global operator new below; the main
+// loop turns the difference across a tick into the allocation metrics, and
+// PreloadLevel folds in what the preload thread allocated.
+thread_local uint64_t thread_allocations = 0;
+
+// Kept out of line: once GCC inlines these into a new/delete pair it sees
+// malloc'd memory reaching delete and raises -Wmismatched-new-delete.
+BACKROOMS_NOINLINE void* operator new(size_t size) {
+    thread_allocations++;
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+BACKROOMS_NOINLINE void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+BACKROOMS_NOINLINE void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+// Sits between cout and the console so every byte the game prints is counted.
+class CountingStreambuf : public std::streambuf {
+public:
+    explicit CountingStreambuf(std::streambuf* target) : target(target) {}
+
+protected:
+    int overflow(int c) override {
+        if (c == traits_type::eof()) {
+            return traits_type::not_eof(c);
+        }
+        metrics.add(kBytesWritten);
+        return target->sputc(static_cast<char>(c));
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        metrics.add(kBytesWritten, static_cast<uint64_t>(n));
+        return target->sputn(s, n);
+    }
+
+    int sync() override {
+        return target->pubsync();
+    }
+
+private:
+    std::streambuf* target;
+};
+
+// Rewrites a Prometheus text file every interval (and once more on stop), for
+// node_exporter's textfile collector or anything else that tails it. The file
+// is written beside the target and moved over it so readers never see half
+// a dump.
+class MetricsExporter {
+public:
+    void start(const string& file, int interval_seconds) {
+        if (worker.joinable()) {
+            return;
+        }
+        path = file;
+        interval = seconds(interval_seconds);
+        stopping = false;
+        worker = std::thread([this] { run(); });
+    }
+
+    void stop() {
+        if (!worker.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+        dump();
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!wake.wait_for(lock, interval, [this] { return stopping; })) {
+            lock.unlock();
+            dump();
+            lock.lock();
+        }
+    }
+
+    void dump() {
+        string temp_path = path + ".tmp";
+        {
+            std::ofstream f(temp_path, std::ios::binary | std::ios::trunc);
+            if (!f.is_open()) {
+                return;
+            }
+            f << metrics.toPrometheus();
+        }
+        MoveFileExA(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+    }
+
+    string path;
+    seconds interval{ 5 };
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+};
+
+MetricsExporter metrics_exporter;
+
+struct CellMask {
+    int width = 0;
+    int height = 0;
+    int stride = 0;
+    vector<uint64_t> bits;
+
+    void reset(int w, int h) {
+        width = w;
+        height = h;
+        stride = (w + 63) / 64;
+        bits.assign(static_cast<size_t>(stride) * h, 0);
+    }
+
+    void set(int x, int y) {
+        bits[y * stride + (x >> 6)] |= uint64_t(1) << (x & 63);
+    }
+
+    bool test(int x, int y) const {
+        return (bits[y * stride + (x >> 6)] >> (x & 63)) & 1;
+    }
+
+    // Bits x..x+15 of row y, reading zeros wherever the span leaves the mask.
+    uint32_t span16(int x, int y) const {
+        if (y < 0 || y >= height || x >= width || x <= -16) {
+            return 0;
+        }
+        const uint64_t* row = &bits[y * stride];
+        if (x < 0) {
+            return static_cast<uint32_t>(row[0] << -x) & 0xFFFF;
+        }
+        int word = x >> 6;
+        int shift = x & 63;
+        uint64_t value = row[word] >> shift;
+        if (shift > 48 && word + 1 < stride) {
+            value |= row[word + 1] << (64 - shift);
+        }
+        return static_cast<uint32_t>(value) & 0xFFFF;
+    }
+
+    // ORs in a smaller mask whose (0, 0) sits at (left, top) in this one;
+    // only the rows and words the smaller mask covers are touched.
+    void merge(const CellMask& other, int left, int top) {
+        for (int oy = 0; oy < other.height; oy++) {
+            int y = top + oy;
+            if (y < 0 || y >= height) {
+                continue;
+            }
+            uint64_t* row = &bits[y * stride];
+            for (int w = 0; w < other.stride; w++) {
+                uint64_t value = other.bits[oy * other.stride + w];
+                int pos = left + w * 64;
+                if (pos < 0) {
+                    value = pos > -64 ? value >> -pos : 0;
+                    pos = 0;
+                }
+                int word = pos >> 6;
+                int shift = pos & 63;
+                if (!value || word >= stride) {
+                    continue;
+                }
+                row[word] |= value << shift;
+                if (shift && word + 1 < stride) {
+                    row[word + 1] |= value >> (64 - shift);
+                }
+            }
+        }
+    }
+};
+
+// A field of view only covers the (2r+1)^2 square around its origin, so it is
+// stored as that window plus the map position of the window's corner.
+struct ViewWindow {
+    int left = 0;
+    int top = 0;
+    CellMask mask;
+
+    void reset(int x, int y, int radius) {
+        left = x - radius;
+        top = y - radius;
+        mask.reset(2 * radius + 1, 2 * radius + 1);
+    }
+
+    void set(int x, int y) {
+        mask.set(x - left, y - top);
+    }
+
+    bool test(int x, int y) const {
+        int lx = x - left;
+        int ly = y - top;
+        return lx >= 0 && lx < mask.width && ly >= 0 && ly < mask.height && mask.test(lx, ly);
+    }
+
+    uint32_t span16(int x, int y) const {
+        return mask.span16(x - left, y - top);
+    }
+};
+
+// Recursive shadowcasting over one octant; xx/xy/yx/yy map the octant's
+// local (dx, dy) back onto map coordinates.
+void CastLight(ViewWindow& view, int ox, int oy, int radius, int row, float start, float end,
+    int xx, int xy, int yx, int yy) {
+    if (start < end) {
+        return;
+    }
+
+    float new_start = 0.0f;
+    for (int j = row; j <= radius; j++) {
+        int dx = -j - 1;
+        int dy = -j;
+        bool blocked = false;
+
+        while (dx <= 0) {
+            dx++;
+            int map_x = ox + dx * xx + dy * xy;
+            int map_y = oy + dx * yx + dy * yy;
+            float left_slope = (dx - 0.5f) / (dy + 0.5f);
+            float right_slope = (dx + 0.5f) / (dy - 0.5f);
+
+            if (start < right_slope) {
+                continue;
+            }
+            else if (end > left_slope) {
+                break;
+            }
+
+            bool inside = map_x >= 0 && map_x < gWidth && map_y >= 0 && map_y < gHeight;
+            if (inside && dx * dx + dy * dy <= radius * radius) {
+                view.set(map_x, map_y);
+            }
+
+            bool opaque = !inside || walls[map_y][map_x];
+            if (blocked) {
+                if (opaque) {
+                    new_start = right_slope;
+                    continue;
+                }
+                blocked = false;
+                start = new_start;
+            }
+            else if (opaque && j < radius) {
+                blocked = true;
+                CastLight(view, ox, oy, radius, j + 1, start, left_slope, xx, xy, yx, yy);
+                new_start = right_slope;
+            }
+        }
+
+        if (blocked) {
+            break;
+        }
+    }
+}
+
+// Field of view is only recomputed when the origin cell has no cached entry,
+// so standing still (or pacing a corridor) costs a hash lookup per tick.
+// When full, the least recently used view is evicted; everything is dropped
+// whenever the wall grid changes.
+class VisibilityCache {
+public:
+    void reset() {
+        views.clear();
+        recent.clear();
+    }
+
+    const ViewWindow& from(int x, int y) {
+        int key = y * gWidth + x;
+        auto found = views.find(key);
+        if (found != views.end()) {
+            recent.splice(recent.begin(), recent, found->second);
+            return found->second->second;
+        }
+
+        if (views.size() >= kMaxCachedViews) {
+            views.erase(recent.back().first);
+            recent.pop_back();
+        }
+
+        static const int octants[8][4] = {
+            { 1, 0, 0, 1 }, { 0, 1, 1, 0 }, { 0, -1, 1, 0 }, { -1, 0, 0, 1 },
+            { -1, 0, 0, -1 }, { 0, -1, -1, 0 }, { 0, 1, -1, 0 }, { 1, 0, 0, -1 },
+        };
+
+        recent.emplace_front(key, ViewWindow());
+        views[key] = recent.begin();
+        ViewWindow& view = recent.front().second;
+        view.reset(x, y, kViewRadius);
+        view.set(x, y);
+        for (const auto& o : octants) {
+            CastLight(view, x, y, kViewRadius, 1, 1.0f, 0.0f, o[0], o[1], o[2], o[3]);
+        }
+        return view;
+    }
+
+private:
+    std::list<std::pair<int, ViewWindow>> recent;
+    std::unordered_map<int, std::list<std::pair<int, ViewWindow>>::iterator> views;
+};
+
+VisibilityCache visibility;
+CellMask explored;
+CellMask wall_mask;
+int explored_origin = -1;
+
+const ViewWindow& PlayerView();
+
 class Item {
 public:
     string type;
@@ -99,8 +612,12 @@ public:
     int move_counter;
     int speed;
     bool frozen;
+    bool has_target;
+    int target_x, target_y;
 
-    Enemy() : move_counter(0), speed(3), character('M'), color(12), frozen(false) {}
+    Enemy() : move_counter(0), speed(3), character('M'), color(12), frozen(false),
+        has_target(false), target_x(0), target_y(0) {
+    }
 
     void loadFromFile(const string& filename) {
         try {
@@ -147,20 +664,37 @@ public:
         move_counter = 0;
 
         if (player_invisible && steady_clock::now() < player_invisible_until) {
+            has_target = false;
             moveRandomly();
             return;
         }
 
+        if (canSeePlayer()) {
+            has_target = true;
+            target_x = player_x;
+            target_y = player_y;
+        }
+
         int new_x = x, new_y = y;
-        if (findPathToPlayer(x, y, new_x, new_y)) {
+        if (has_target && findPathToTarget(x, y, new_x, new_y)) {
             x = new_x;
             y = new_y;
+            if (x == target_x && y == target_y) {
+                has_target = false;
+            }
             return;
         }
 
+        has_target = false;
         moveRandomly();
     }
 
+    // Sight is checked against the player's cached field of view: one lookup
+    // per enemy instead of a shadowcast from every enemy's cell.
+    bool canSeePlayer() const {
+        return PlayerView().test(x, y);
+    }
+
 private:
     void moveRandomly() {
         const int dx[] = { 0, 1, 0, -1 };
@@ -183,63 +717,111 @@ private:
         }
     }
 
-    bool findPathToPlayer(int start_x, int start_y, int& out_x, int& out_y) {
+    // A target is only ever set from inside the player's view, so the search
+    // stays in a square of kChaseRadius around the enemy. The scratch buffers
+    // are sized to that square once and reused; the generation stamp stands
+    // in for clearing them between searches.
+    bool findPathToTarget(int start_x, int start_y, int& out_x, int& out_y) {
         if (player_invisible && steady_clock::now() < player_invisible_until) {
             return false;
         }
 
+        if (abs(target_x - start_x) > kChaseRadius || abs(target_y - start_y) > kChaseRadius) {
+            return false;
+        }
+
         const int dx[] = { 0, 1, 0, -1 };
         const int dy[] = { -1, 0, 1, 0 };
+        const int side = 2 * kChaseRadius + 1;
+        const int left = start_x - kChaseRadius;
+        const int top = start_y - kChaseRadius;
+
+        if (search_stamp.empty()) {
+            search_stamp.assign(side * side, 0);
+            search_prev.assign(side * side, -1);
+            search_queue.reserve(side * side);
+        }
+        if (++search_generation == 0) {
+            std::fill(search_stamp.begin(), search_stamp.end(), 0);
+            search_generation = 1;
+        }
 
-        vector<vector<bool>> visited(gHeight, vector<bool>(gWidth, false));
-        vector<vector<std::pair<int, int>>> prev(gHeight, vector<std::pair<int, int>>(gWidth, { -1, -1 }));
-
-        std::queue<std::pair<int, int>> q;
-        q.push({ start_x, start_y });
-        visited[start_y][start_x] = true;
-
-        while (!q.empty()) {
-            auto current = q.front();
-            q.pop();
-
-            if (current.first == player_x && current.second == player_y) {
-                std::pair<int, int> step = current;
-                while (prev[step.second][step.first] != std::pair<int, int>(start_x, start_y) &&
-                    prev[step.second][step.first] != std::pair<int, int>(-1, -1)) {
-                    step = prev[step.second][step.first];
+        int start = kChaseRadius * side + kChaseRadius;
+        search_queue.clear();
+        search_queue.push_back(start);
+        search_stamp[start] = search_generation;
+        search_prev[start] = -1;
+
+        uint64_t expanded = 0;
+        metrics.add(kPathSearches);
+
+        for (size_t head = 0; head < search_queue.size(); head++) {
+            int current = search_queue[head];
+            int cx = left + current % side;
+            int cy = top + current / side;
+            expanded++;
+
+            if (cx == target_x && cy == target_y) {
+                metrics.add(kPathNodesExpanded, expanded);
+                metrics.observe(kPathNodesPerSearch, expanded);
+                int step = current;
+                while (search_prev[step] != start && search_prev[step] != -1) {
+                    step = search_prev[step];
                 }
-                out_x = step.first;
-                out_y = step.second;
+                out_x = left + step % side;
+                out_y = top + step / side;
                 return true;
             }
 
             for (int i = 0; i < 4; i++) {
-                int nx = current.first + dx[i];
-                int ny = current.second + dy[i];
-
-                if (nx >= 0 && nx < gWidth && ny >= 0 && ny < gHeight &&
-                    !walls[ny][nx] && !visited[ny][nx]) {
-                    visited[ny][nx] = true;
-                    prev[ny][nx] = current;
-                    q.push({ nx, ny });
+                int nx = cx + dx[i];
+                int ny = cy + dy[i];
+                int lx = nx - left;
+                int ly = ny - top;
+
+                if (lx < 0 || lx >= side || ly < 0 || ly >= side ||
+                    nx < 0 || nx >= gWidth || ny < 0 || ny >= gHeight || walls[ny][nx]) {
+                    continue;
+                }
+
+                int next = ly * side + lx;
+                if (search_stamp[next] != search_generation) {
+                    search_stamp[next] = search_generation;
+                    search_prev[next] = current;
+                    search_queue.push_back(next);
                 }
             }
         }
 
+        metrics.add(kPathNodesExpanded, expanded);
+        metrics.observe(kPathNodesPerSearch, expanded);
         return false;
     }
+
+    vector<int> search_stamp;
+    vector<int> search_prev;
+    vector<int> search_queue;
+    int search_generation = 0;
 };
 
 Enemy enemy;
 
-void LoadLevel(const string& filename);
+void LoadLevelManifest(const string& filename);
+LevelData ParseLevelFile(const string& filename);
+LevelData GenerateLevel(const LevelEntry& entry);
+LevelData PrepareLevel(const LevelEntry& entry, unsigned int spawn_seed);
+LevelData PreloadLevel(const LevelEntry& entry, unsigned int spawn_seed);
+void ApplyLevel(LevelData&& level);
+void PreloadNextLevel();
+void AdvanceLevel();
+void StartLevel();
 void Setup();
 void Draw();
 void Input();
 void Logic();
-void ClearBuffers();
 void UpdateBuffer();
 void RenderBuffer();
+void BenchmarkCompose();
 void LoadItems(const string& filename, vector<Item>& templates);
 void UseItem(int index);
 void ApplyEffect(const Item& item);
@@ -249,6 +831,21 @@ void SetColor(int color) {
     SetConsoleTextAttribute(hConsole, color);
 }
 
+// Blanks the map and the status rows RenderBuffer writes below it, so a
+// smaller next level doesn't leave the old frame on screen.
+void ClearConsoleArea(int height) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    if (!GetConsoleScreenBufferInfo(hConsole, &info)) {
+        return;
+    }
+
+    COORD origin = { 0, 0 };
+    DWORD cells = static_cast<DWORD>(info.dwSize.X) * static_cast<DWORD>(height + 8);
+    DWORD written = 0;
+    FillConsoleOutputCharacterA(hConsole, ' ', cells, origin, &written);
+    FillConsoleOutputAttribute(hConsole, kTextColor, cells, origin, &written);
+}
+
 void LoadItems(const string& filename, vector<Item>& templates) {
     templates.clear();
     try {
@@ -307,7 +904,49 @@ void LoadItems(const string& filename, vector<Item>& templates) {
     }
 }
 
-void LoadLevel(const string& filename) {
+void LoadLevelManifest(const string& filename) {
+    level_sequence.clear();
+    try {
+        std::ifstream f(filename);
+        if (!f.is_open()) {
+            throw std::runtime_error("Could not open level manifest");
+        }
+
+        json data = json::parse(f);
+        if (data.contains("levels") && data["levels"].is_array()) {
+            for (auto& level_data : data["levels"]) {
+                LevelEntry entry;
+                if (level_data.is_string()) {
+                    entry.file = level_data.get<string>();
+                }
+                else if (level_data.is_object()) {
+                    entry.file = level_data.value("file", "");
+                    entry.name = level_data.value("name", "");
+                    entry.seed = level_data.value("seed", 0u);
+                    entry.width = level_data.value("width", 40);
+                    entry.height = level_data.value("height", 20);
+                    entry.procedural = entry.file.empty();
+                }
+                else {
+                    continue;
+                }
+                level_sequence.push_back(entry);
+            }
+        }
+    }
+    catch (const std::exception& e) {
+        level_sequence.clear();
+    }
+
+    if (level_sequence.empty()) {
+        LevelEntry entry;
+        entry.file = "level.json";
+        level_sequence.push_back(entry);
+    }
+}
+
+LevelData ParseLevelFile(const string& filename) {
+    LevelData level;
     try {
         std::ifstream f(filename);
         if (!f.is_open()) {
@@ -316,83 +955,403 @@ void LoadLevel(const string& filename) {
 
         json data = json::parse(f);
 
-        gWidth = data.value("width", 40);
-        gHeight = data.value("height", 20);
+        level.name = data.value("name", filename);
+        level.width = data.value("width", 40);
+        level.height = data.value("height", 20);
 
-        walls = vector<vector<bool>>(gHeight, vector<bool>(gWidth, false));
+        level.walls = vector<vector<bool>>(level.height, vector<bool>(level.width, false));
 
         if (data.contains("map") && data["map"].is_array()) {
             vector<string> mapData = data["map"].get<vector<string>>();
 
-            if (mapData.size() < static_cast<size_t>(gHeight)) {
+            if (mapData.size() < static_cast<size_t>(level.height)) {
                 throw std::runtime_error("Map height doesn't match specified height");
             }
 
-            for (int y = 0; y < gHeight; y++) {
+            for (int y = 0; y < level.height; y++) {
                 string row = mapData[y];
-                if (row.length() < static_cast<size_t>(gWidth)) {
-                    row += string(gWidth - row.length(), ' ');
+                if (row.length() < static_cast<size_t>(level.width)) {
+                    row += string(level.width - row.length(), ' ');
                 }
 
-                for (int x = 0; x < gWidth; x++) {
-                    walls[y][x] = (row[x] == '#');
+                for (int x = 0; x < level.width; x++) {
+                    level.walls[y][x] = (row[x] == '#');
                 }
             }
         }
-
-        screen_buffer = vector<string>(gHeight, string(gWidth, ' '));
-        color_buffer = vector<WORD>(gHeight * gWidth, kWallColor);
     }
     catch (const std::exception& e) {
-        gWidth = 40;
-        gHeight = 20;
-        walls = vector<vector<bool>>(gHeight, vector<bool>(gWidth, false));
-        screen_buffer = vector<string>(gHeight, string(gWidth, ' '));
-        color_buffer = vector<WORD>(gHeight * gWidth, kWallColor);
-
-        for (int y = 0; y < gHeight; y++) {
-            for (int x = 0; x < gWidth; x++) {
-                if (y == 0 || y == gHeight - 1 || x == 0 || x == gWidth - 1) {
-                    walls[y][x] = true;
+        level.name = filename;
+        level.width = 40;
+        level.height = 20;
+        level.walls = vector<vector<bool>>(level.height, vector<bool>(level.width, false));
+
+        for (int y = 0; y < level.height; y++) {
+            for (int x = 0; x < level.width; x++) {
+                if (y == 0 || y == level.height - 1 || x == 0 || x == level.width - 1) {
+                    level.walls[y][x] = true;
                 }
             }
         }
     }
+    return level;
+}
+
+// Carves a maze on the odd grid with a seeded backtracker, then knocks out
+// extra walls so the monster cannot trap the player in long dead ends.
+LevelData GenerateLevel(const LevelEntry& entry) {
+    LevelData level;
+    level.width = (std::max)(entry.width, 5);
+    level.height = (std::max)(entry.height, 5);
+    level.name = entry.name.empty() ? "Level #" + std::to_string(entry.seed) : entry.name;
+    level.walls = vector<vector<bool>>(level.height, vector<bool>(level.width, true));
+
+    std::mt19937 g(entry.seed);
+    const int dx[] = { 0, 2, 0, -2 };
+    const int dy[] = { -2, 0, 2, 0 };
+
+    vector<std::pair<int, int>> stack = { { 1, 1 } };
+    level.walls[1][1] = false;
+    while (!stack.empty()) {
+        auto current = stack.back();
+        vector<int> directions = { 0, 1, 2, 3 };
+        std::shuffle(directions.begin(), directions.end(), g);
+
+        bool carved = false;
+        for (int dir : directions) {
+            int nx = current.first + dx[dir];
+            int ny = current.second + dy[dir];
+            if (nx > 0 && nx < level.width - 1 && ny > 0 && ny < level.height - 1 &&
+                level.walls[ny][nx]) {
+                level.walls[current.second + dy[dir] / 2][current.first + dx[dir] / 2] = false;
+                level.walls[ny][nx] = false;
+                stack.push_back({ nx, ny });
+                carved = true;
+                break;
+            }
+        }
+        if (!carved) {
+            stack.pop_back();
+        }
+    }
+
+    // The maze only lands on odd coordinates, so an even size leaves the last
+    // interior column/row as a second wall; open it into an edge corridor.
+    if (level.width % 2 == 0) {
+        for (int y = 1; y < level.height - 1; y++) {
+            level.walls[y][level.width - 2] = false;
+        }
+    }
+    if (level.height % 2 == 0) {
+        for (int x = 1; x < level.width - 1; x++) {
+            level.walls[level.height - 2][x] = false;
+        }
+    }
+
+    int openings = level.width * level.height / 12;
+    for (int i = 0; i < openings; i++) {
+        int x = 1 + static_cast<int>(g() % (level.width - 2));
+        int y = 1 + static_cast<int>(g() % (level.height - 2));
+        level.walls[y][x] = false;
+    }
+    return level;
 }
 
-void ClearBuffers() {
-    for (auto& row : screen_buffer) {
-        std::fill(row.begin(), row.end(), ' ');
+// Runs on the preload thread: touches nothing but its arguments, so the
+// main loop keeps ticking while the next level is parsed and analysed.
+LevelData PrepareLevel(const LevelEntry& entry, unsigned int spawn_seed) {
+    LevelData level = entry.procedural ? GenerateLevel(entry) : ParseLevelFile(entry.file);
+    if (!entry.name.empty()) {
+        level.name = entry.name;
+    }
+
+    vector<std::pair<int, int>> open_cells;
+    for (int y = 0; y < level.height; y++) {
+        for (int x = 0; x < level.width; x++) {
+            if (!level.walls[y][x]) {
+                open_cells.push_back({ x, y });
+            }
+        }
+    }
+
+    level.spawn_distance = vector<int>(level.width * level.height, -1);
+    if (open_cells.empty()) {
+        level.walls[level.height / 2][level.width / 2] = false;
+        open_cells.push_back({ level.width / 2, level.height / 2 });
     }
-    std::fill(color_buffer.begin(), color_buffer.end(), kWallColor);
+
+    std::mt19937 g(spawn_seed);
+    auto spawn = open_cells[g() % open_cells.size()];
+    level.spawn_x = spawn.first;
+    level.spawn_y = spawn.second;
+
+    // Everything that spawns later (items, the enemy) is drawn from the cells
+    // reachable from the player, and the BFS distances let Setup keep the
+    // enemy a real walking distance away instead of a Manhattan one.
+    const int dx[] = { 0, 1, 0, -1 };
+    const int dy[] = { -1, 0, 1, 0 };
+    std::queue<std::pair<int, int>> q;
+    q.push(spawn);
+    level.spawn_distance[spawn.second * level.width + spawn.first] = 0;
+    while (!q.empty()) {
+        auto current = q.front();
+        q.pop();
+        level.free_cells.push_back(current);
+        int distance = level.spawn_distance[current.second * level.width + current.first];
+
+        for (int i = 0; i < 4; i++) {
+            int nx = current.first + dx[i];
+            int ny = current.second + dy[i];
+
+            if (nx >= 0 && nx < level.width && ny >= 0 && ny < level.height &&
+                !level.walls[ny][nx] && level.spawn_distance[ny * level.width + nx] < 0) {
+                level.spawn_distance[ny * level.width + nx] = distance + 1;
+                q.push({ nx, ny });
+            }
+        }
+    }
+    return level;
 }
 
-void UpdateBuffer() {
+const ViewWindow& PlayerView() {
+    const ViewWindow& view = visibility.from(player_x, player_y);
+    int origin = player_y * gWidth + player_x;
+    if (origin != explored_origin) {
+        explored.merge(view.mask, view.left, view.top);
+        explored_origin = origin;
+    }
+    return view;
+}
+
+void ApplyLevel(LevelData&& level) {
+    gWidth = level.width;
+    gHeight = level.height;
+    level_name = std::move(level.name);
+    walls = std::move(level.walls);
+    free_cells = std::move(level.free_cells);
+    spawn_distance = std::move(level.spawn_distance);
+    player_x = level.spawn_x;
+    player_y = level.spawn_y;
+
+    screen_buffer = vector<char>(gHeight * gWidth, kEmpty);
+    color_buffer = vector<WORD>(gHeight * gWidth, kWallColor);
+
+    wall_mask.reset(gWidth, gHeight);
     for (int y = 0; y < gHeight; y++) {
         for (int x = 0; x < gWidth; x++) {
-            screen_buffer[y][x] = walls[y][x] ? kWall : kEmpty;
-            color_buffer[y * gWidth + x] = kWallColor;
+            if (walls[y][x]) {
+                wall_mask.set(x, y);
+            }
+        }
+    }
+
+    visibility.reset();
+    explored.reset(gWidth, gHeight);
+    explored_origin = -1;
+}
+
+LevelData PreloadLevel(const LevelEntry& entry, unsigned int spawn_seed) {
+    uint64_t allocations_before = thread_allocations;
+    LevelData level = PrepareLevel(entry, spawn_seed);
+    metrics.add(kAllocations, thread_allocations - allocations_before);
+    return level;
+}
+
+void PreloadNextLevel() {
+    int next = current_level + 1;
+    if (next >= static_cast<int>(level_sequence.size())) {
+        return;
+    }
+    next_level = std::async(std::launch::async, PreloadLevel,
+        level_sequence[next], static_cast<unsigned int>(rand()));
+}
+
+void AdvanceLevel() {
+    auto transition_start = steady_clock::now();
+
+    int previous_height = gHeight;
+    current_level++;
+    LevelData level = next_level.valid()
+        ? next_level.get()
+        : PrepareLevel(level_sequence[current_level], static_cast<unsigned int>(rand()));
+    ApplyLevel(std::move(level));
+    StartLevel();
+    PreloadNextLevel();
+    ClearConsoleArea(previous_height);
+
+    last_transition_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        steady_clock::now() - transition_start).count();
+}
+
+struct Stamp {
+    int x, y;
+    char character;
+    WORD color;
+};
+
+vector<Stamp> stamps;
+
+void ComposeStaticSpan(const ViewWindow& view, int y, int x_begin, int x_end) {
+    for (int x = x_begin; x < x_end; x++) {
+        int i = y * gWidth + x;
+        bool visible = view.test(x, y);
+        bool seen = visible || explored.test(x, y);
+        screen_buffer[i] = (seen && wall_mask.test(x, y)) ? kWall : kEmpty;
+        color_buffer[i] = (seen && !visible) ? kFogColor : kWallColor;
+    }
+}
+
+#ifdef BACKROOMS_SSE2
+// Widens 16 mask bits into 16 bytes of 0x00/0xFF, bit 0 landing in byte 0.
+static inline __m128i ExpandBits16(uint32_t bits) {
+    const __m128i select = _mm_set_epi8(
+        -128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1);
+    __m128i spread = _mm_set_epi64x(
+        static_cast<long long>(((bits >> 8) & 0xFF) * 0x0101010101010101ULL),
+        static_cast<long long>((bits & 0xFF) * 0x0101010101010101ULL));
+    return _mm_cmpeq_epi8(_mm_and_si128(spread, select), select);
+}
+#endif
+
+// Builds the wall/fog layer a row at a time straight from the packed masks,
+// sixteen cells per step: the chars come from one byte blend and the colours
+// from two word blends over the same expanded mask.
+void ComposeStaticLayer(const ViewWindow& view) {
+    for (int y = 0; y < gHeight; y++) {
+        int x = 0;
+#ifdef BACKROOMS_SSE2
+        const __m128i wall_chars = _mm_set1_epi8(kWall);
+        const __m128i empty_chars = _mm_set1_epi8(kEmpty);
+        const __m128i wall_colors = _mm_set1_epi16(kWallColor);
+        const __m128i fog_colors = _mm_set1_epi16(kFogColor);
+
+        const uint64_t* wall_row = &wall_mask.bits[y * wall_mask.stride];
+        const uint64_t* explored_row = &explored.bits[y * explored.stride];
+        char* chars = &screen_buffer[y * gWidth];
+        WORD* colors = &color_buffer[y * gWidth];
+
+        for (; x + 16 <= gWidth; x += 16) {
+            int word = x >> 6;
+            int shift = x & 63;
+            uint32_t visible = view.span16(x, y);
+            uint32_t seen = visible | (static_cast<uint32_t>(explored_row[word] >> shift) & 0xFFFF);
+            uint32_t wall = static_cast<uint32_t>(wall_row[word] >> shift) & seen;
+
+            __m128i wall_bytes = ExpandBits16(wall);
+            __m128i char_span = _mm_or_si128(_mm_and_si128(wall_bytes, wall_chars),
+                _mm_andnot_si128(wall_bytes, empty_chars));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(chars + x), char_span);
+
+            __m128i fog_bytes = ExpandBits16(seen & ~visible);
+            __m128i fog_lo = _mm_unpacklo_epi8(fog_bytes, fog_bytes);
+            __m128i fog_hi = _mm_unpackhi_epi8(fog_bytes, fog_bytes);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(colors + x),
+                _mm_or_si128(_mm_and_si128(fog_lo, fog_colors), _mm_andnot_si128(fog_lo, wall_colors)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(colors + x + 8),
+                _mm_or_si128(_mm_and_si128(fog_hi, fog_colors), _mm_andnot_si128(fog_hi, wall_colors)));
         }
+#endif
+        ComposeStaticSpan(view, y, x, gWidth);
     }
+}
+
+void UpdateBuffer() {
+    const ViewWindow& view = PlayerView();
+
+    ComposeStaticLayer(view);
 
+    stamps.clear();
     for (const auto& item : items) {
-        if (item.y >= 0 && item.y < gHeight && item.x >= 0 && item.x < gWidth) {
-            screen_buffer[item.y][item.x] = item.character;
-            color_buffer[item.y * gWidth + item.x] = item.color;
+        if (item.y >= 0 && item.y < gHeight && item.x >= 0 && item.x < gWidth &&
+            view.test(item.x, item.y)) {
+            stamps.push_back({ item.x, item.y, item.character, static_cast<WORD>(item.color) });
         }
     }
 
-    if (enemy.y >= 0 && enemy.y < gHeight && enemy.x >= 0 && enemy.x < gWidth) {
-        screen_buffer[enemy.y][enemy.x] = enemy.character;
-        color_buffer[enemy.y * gWidth + enemy.x] = enemy.frozen ? 9 : enemy.color;
+    if (enemy.y >= 0 && enemy.y < gHeight && enemy.x >= 0 && enemy.x < gWidth &&
+        view.test(enemy.x, enemy.y)) {
+        stamps.push_back({ enemy.x, enemy.y, enemy.character,
+            static_cast<WORD>(enemy.frozen ? 9 : enemy.color) });
     }
 
     if (player_y >= 0 && player_y < gHeight && player_x >= 0 && player_x < gWidth) {
-        screen_buffer[player_y][player_x] = kPlayer;
-        color_buffer[player_y * gWidth + player_x] = player_invisible ? 8 : kPlayerColor;
+        stamps.push_back({ player_x, player_y, kPlayer,
+            static_cast<WORD>(player_invisible ? 8 : kPlayerColor) });
+    }
+
+    for (const auto& stamp : stamps) {
+        screen_buffer[stamp.y * gWidth + stamp.x] = stamp.character;
+        color_buffer[stamp.y * gWidth + stamp.x] = stamp.color;
     }
 }
 
+// Times the static layer on a large generated level: the per-cell loop the
+// game used to run over a 2D buffer versus ComposeStaticLayer.
+void BenchmarkCompose() {
+    LevelEntry entry;
+    entry.procedural = true;
+    entry.seed = 42;
+    entry.width = 1024;
+    entry.height = 512;
+    ApplyLevel(PrepareLevel(entry, 42));
+
+    std::mt19937 g(7);
+    for (auto& word : explored.bits) {
+        word = (uint64_t(g()) << 32) | g();
+    }
+    const ViewWindow& view = visibility.from(player_x, player_y);
+
+    const int iterations = 200;
+    const double cells = static_cast<double>(gWidth) * gHeight * iterations;
+
+    vector<string> legacy_chars(gHeight, string(gWidth, ' '));
+    vector<WORD> legacy_colors(gHeight * gWidth, kWallColor);
+    auto legacy_start = steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        for (int y = 0; y < gHeight; y++) {
+            for (int x = 0; x < gWidth; x++) {
+                if (view.test(x, y)) {
+                    legacy_chars[y][x] = walls[y][x] ? kWall : kEmpty;
+                    legacy_colors[y * gWidth + x] = kWallColor;
+                }
+                else if (explored.test(x, y)) {
+                    legacy_chars[y][x] = walls[y][x] ? kWall : kEmpty;
+                    legacy_colors[y * gWidth + x] = kFogColor;
+                }
+                else {
+                    legacy_chars[y][x] = kEmpty;
+                    legacy_colors[y * gWidth + x] = kWallColor;
+                }
+            }
+        }
+    }
+    double legacy_ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        steady_clock::now() - legacy_start).count());
+
+    auto simd_start = steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        ComposeStaticLayer(view);
+    }
+    double simd_ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        steady_clock::now() - simd_start).count());
+
+    bool match = true;
+    for (int y = 0; y < gHeight && match; y++) {
+        for (int x = 0; x < gWidth; x++) {
+            if (legacy_chars[y][x] != screen_buffer[y * gWidth + x] ||
+                legacy_colors[y * gWidth + x] != color_buffer[y * gWidth + x]) {
+                match = false;
+                break;
+            }
+        }
+    }
+
+    cout << "Composed " << gWidth << "x" << gHeight << " cells x " << iterations << "\n";
+    cout << "Nested loops:       " << cells / legacy_ns << " cells/ns\n";
+    cout << "ComposeStaticLayer: " << cells / simd_ns << " cells/ns\n";
+    cout << "Output " << (match ? "matches" : "DIFFERS") << endl;
+}
+
 void RenderBuffer() {
     static COORD cursor_pos = { 0, 0 };
 
@@ -401,7 +1360,7 @@ void RenderBuffer() {
     for (int y = 0; y < gHeight; y++) {
         for (int x = 0; x < gWidth; x++) {
             SetColor(color_buffer[y * gWidth + x]);
-            cout << screen_buffer[y][x];
+            cout << screen_buffer[y * gWidth + x];
         }
         cout << '\n';
     }
@@ -419,6 +1378,11 @@ void RenderBuffer() {
     COORD status_pos = { 0, static_cast<SHORT>(gHeight) };
     SetConsoleCursorPosition(hConsole, status_pos);
 
+    cout << "Level " << current_level + 1 << "/" << level_sequence.size() << ": " << level_name;
+    if (last_transition_us >= 0) {
+        cout << " (loaded in " << last_transition_us << " us)";
+    }
+    cout << "\n";
     cout << "Time left: " << (timer > 0 ? timer : 0) << " seconds\n";
     cout << "Enemy: " << enemy.name << " (speed: " << enemy.speed << ")";
 
@@ -443,7 +1407,8 @@ void RenderBuffer() {
         cout << "\n";
     }
 
-    cout << "Bottles collected: " << bottles_collected << "\n";
+    cout << "Bottles collected: " << level_bottles << "/" << WINNING_BOTTLES_COUNT
+        << " (total " << bottles_collected << ")\n";
 
     cout << "Inventory: ";
     if (inventory.empty()) {
@@ -464,9 +1429,9 @@ void RenderBuffer() {
 }
 
 void Draw() {
-    ClearBuffers();
     UpdateBuffer();
     RenderBuffer();
+    metrics.add(kFramesRendered);
 }
 
 void ApplyEffect(const Item& item) {
@@ -505,36 +1470,29 @@ void UseBatIfAvailable() {
     }
 }
 
-void Setup() {
-    game_over = false;
-    game_won = false;
-    bottles_collected = 0;
-    inventory.clear();
+void StartLevel() {
+    level_bottles = 0;
+    time_bonus = 0;
     monster_frozen = false;
     player_invisible = false;
+    enemy.frozen = false;
+    enemy.has_target = false;
+    enemy.move_counter = 0;
     start_time = steady_clock::now();
 
-    LoadLevel("level.json");
-
-    enemy.loadFromFile("enemy.json");
-
-    LoadItems("items.json", item_templates);
-
-    do {
-        player_x = rand() % gWidth;
-        player_y = rand() % gHeight;
-    } while (walls[player_y][player_x]);
-
     items.clear();
     for (int i = 0; i < 3; i++) {
-        if (!item_templates.empty()) {
+        if (!item_templates.empty() && free_cells.size() > static_cast<size_t>(i + 1)) {
             int index = rand() % item_templates.size();
             Item new_item = item_templates[index];
             bool position_ok;
+            int attempts = 0;
             do {
+                attempts++;
                 position_ok = true;
-                new_item.x = rand() % gWidth;
-                new_item.y = rand() % gHeight;
+                auto cell = free_cells[rand() % free_cells.size()];
+                new_item.x = cell.first;
+                new_item.y = cell.second;
 
                 if (walls[new_item.y][new_item.x]) {
                     position_ok = false;
@@ -554,19 +1512,49 @@ void Setup() {
                 }
             } while (!position_ok);
             items.push_back(new_item);
+            metrics.add(kItemsSpawned);
+            metrics.add(kSpawnRetries, attempts - 1);
         }
     }
 
     int min_distance = 10;
-    do {
-        enemy.x = rand() % gWidth;
-        enemy.y = rand() % gHeight;
-    } while (walls[enemy.y][enemy.x] ||
-        (enemy.x == player_x && enemy.y == player_y) ||
-        std::any_of(items.begin(), items.end(), [&](const Item& item) {
-            return item.x == enemy.x && item.y == enemy.y;
-            }) ||
-        (abs(enemy.x - player_x) + abs(enemy.y - player_y) < min_distance));
+    vector<std::pair<int, int>> enemy_cells;
+    std::pair<int, int> farthest = { player_x, player_y };
+    for (const auto& cell : free_cells) {
+        bool occupied = std::any_of(items.begin(), items.end(), [&](const Item& item) {
+            return item.x == cell.first && item.y == cell.second;
+            });
+        if (occupied) {
+            continue;
+        }
+        int distance = spawn_distance[cell.second * gWidth + cell.first];
+        if (distance >= min_distance) {
+            enemy_cells.push_back(cell);
+        }
+        if (distance > spawn_distance[farthest.second * gWidth + farthest.first]) {
+            farthest = cell;
+        }
+    }
+    auto enemy_cell = enemy_cells.empty() ? farthest : enemy_cells[rand() % enemy_cells.size()];
+    enemy.x = enemy_cell.first;
+    enemy.y = enemy_cell.second;
+}
+
+void Setup() {
+    game_over = false;
+    game_won = false;
+    bottles_collected = 0;
+    inventory.clear();
+
+    enemy.loadFromFile("enemy.json");
+
+    LoadItems("items.json", item_templates);
+
+    LoadLevelManifest("levels.json");
+    current_level = 0;
+    ApplyLevel(PrepareLevel(level_sequence[0], static_cast<unsigned int>(rand())));
+    StartLevel();
+    PreloadNextLevel();
 }
 
 void Input() {
@@ -616,6 +1604,7 @@ void Logic() {
                 ApplyEffect(*it);
                 if (it->type == "bottle") {
                     bottles_collected++;
+                    level_bottles++;
                 }
             }
             else {
@@ -626,14 +1615,17 @@ void Logic() {
 
             it = items.erase(it);
 
-            if (!item_templates.empty()) {
+            if (!item_templates.empty() && free_cells.size() > items.size() + 2) {
                 int index = rand() % item_templates.size();
                 Item new_item = item_templates[index];
                 bool position_ok;
+                int attempts = 0;
                 do {
+                    attempts++;
                     position_ok = true;
-                    new_item.x = rand() % gWidth;
-                    new_item.y = rand() % gHeight;
+                    auto cell = free_cells[rand() % free_cells.size()];
+                    new_item.x = cell.first;
+                    new_item.y = cell.second;
 
                     if (walls[new_item.y][new_item.x]) {
                         position_ok = false;
@@ -658,6 +1650,8 @@ void Logic() {
                     }
                 } while (!position_ok);
                 items.push_back(new_item);
+                metrics.add(kItemsSpawned);
+                metrics.add(kSpawnRetries, attempts - 1);
             }
 
             break;
@@ -667,7 +1661,11 @@ void Logic() {
         }
     }
 
-    if (bottles_collected >= WINNING_BOTTLES_COUNT) {
+    if (level_bottles >= WINNING_BOTTLES_COUNT) {
+        if (current_level + 1 < static_cast<int>(level_sequence.size())) {
+            AdvanceLevel();
+            return;
+        }
         game_won = true;
         game_over = true;
     }
@@ -698,9 +1696,28 @@ void Logic() {
     if (timer <= 0) game_over = true;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
     SetConsoleOutputCP(CP_UTF8);
     srand(static_cast<unsigned int>(time(nullptr)));
+
+    if (argc > 1 && string(argv[1]) == "--bench-compose") {
+        BenchmarkCompose();
+        return 0;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "--metrics") {
+            string metrics_path = "metrics.prom";
+            if (i + 1 < argc && string(argv[i + 1]).rfind("--", 0) != 0) {
+                metrics_path = argv[++i];
+            }
+            metrics_exporter.start(metrics_path, 5);
+        }
+    }
+
+    CountingStreambuf counting_out(cout.rdbuf());
+    std::streambuf* console_out = cout.rdbuf(&counting_out);
+
     Setup();
 
     CONSOLE_CURSOR_INFO cursorInfo;
@@ -709,9 +1726,19 @@ int main() {
     SetConsoleCursorInfo(hConsole, &cursorInfo);
 
     while (!game_over) {
+        auto tick_start = steady_clock::now();
+        uint64_t allocations_before = thread_allocations;
+
         Draw();
         Input();
         Logic();
+
+        uint64_t allocated = thread_allocations - allocations_before;
+        metrics.add(kTicks);
+        metrics.add(kAllocations, allocated);
+        metrics.observe(kAllocationsPerTick, allocated);
+        metrics.observe(kTickMicros, std::chrono::duration_cast<std::chrono::microseconds>(
+            steady_clock::now() - tick_start).count());
         std::this_thread::sleep_for(std::chrono::milliseconds(50));
     }
 
@@ -721,7 +1748,7 @@ int main() {
     SetColor(kTextColor);
     if (game_won) {
         cout << "\nCONGRATULATIONS! You collected " << bottles_collected
-            << " bottles and won the game!" << endl;
+            << " bottles across " << level_sequence.size() << " levels and won the game!" << endl;
     }
     else if (timer <= 0) {
         cout << "\nGAME OVER! Time's up!" << endl;
@@ -731,6 +1758,13 @@ int main() {
     }
 
     cout << "Total bottles collected: " << bottles_collected << endl;
+    cout << "Reached level " << current_level + 1 << " of " << level_sequence.size() << endl;
+    if (last_transition_us >= 0) {
+        cout << "Last level transition: " << last_transition_us << " us" << endl;
+    }
+
+    cout.rdbuf(console_out);
+    metrics_exporter.stop();
 
     return 0;
-}
\ No newline at end of file
+}
\ No newline at end of file